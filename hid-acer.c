@@ -13,10 +13,67 @@
 
 #include <linux/device.h>
 #include <linux/hid.h>
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pm_runtime.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/usb.h>
+#include <linux/version.h>
 
 #include "hid-ids.h"
 
+#ifndef READ_ONCE
+#define READ_ONCE(x)		ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val)	(ACCESS_ONCE(x) = (val))
+#endif
+
+static int autosuspend_delay = -1;
+module_param(autosuspend_delay, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay,
+	"USB autosuspend delay in ms, enables autosuspend when >= 0 (default: -1 = leave unchanged)");
+
+static unsigned int connect_mask = HID_CONNECT_DEFAULT;
+module_param(connect_mask, uint, 0444);
+MODULE_PARM_DESC(connect_mask,
+	"HID_CONNECT_* mask passed to hid_hw_start (default: HID_CONNECT_DEFAULT)");
+
+static unsigned int dwt_timeout_ms;
+module_param(dwt_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(dwt_timeout_ms,
+	"Ignore touchpad motion and taps for this many ms after a key press (default: 0 = disabled)");
+
+/* State shared by all HID devices (interfaces) of one USB device. Devices
+ * that are not on USB get their own instance.
+ */
+struct acer_shared {
+	struct list_head list;
+	void *key;			/* usb_device, or the hid_device itself */
+	unsigned int refcount;		/* protected by acer_shared_mutex */
+	struct usb_device *udev;	/* set while we changed autosuspend */
+	int saved_delay;		/* autosuspend delay to restore */
+	bool saved_auto;		/* runtime PM was allowed before */
+	unsigned long last_key;		/* jiffies of last non-modifier key press */
+};
+
+static LIST_HEAD(acer_shared_list);
+static DEFINE_MUTEX(acer_shared_mutex);
+
+struct acer_data {
+	struct acer_shared *shared;
+	struct usb_device *udev;	/* NULL unless bound through usbhid */
+	spinlock_t lock;	/* protects the wake-up latency fields below */
+	bool wake_pending;	/* autosuspended, first report not yet measured */
+	u64 wake_start_ns;	/* start of the autoresume, 0 until known */
+	u64 wake_report_ns;	/* arrival of the first report, 0 until seen */
+	u64 wake_latency_ns;	/* autoresume to first report of last wake-up */
+};
+
 /* Acer keyboards e.g. in Acer SW5-012 use synaptics touchpad USB ID
  * (06cb:2968 and 06CB:2991) and have the following issue:
  * - The report descriptor specifies an excessively large number of usages
@@ -52,6 +109,375 @@ static __u8 *acer_kbd_report_fixup(struct hid_device *hdev, __u8 *rdesc,
 	return rdesc;
 }
 
+/* Ignore every usage inside a vendor-defined application collection
+ * (usage pages 0xFF00-0xFFFF). hid-input already ignores usages on page
+ * 0xFF00 (HID_UP_MSVENDOR) itself; this additionally covers the other
+ * vendor pages, which hid-input maps to BTN_MISC/ABS_MISC, and standard
+ * page usages placed inside such a collection. The collections stay
+ * reachable through hidraw.
+ */
+#define ACER_VENDOR_PAGE		0xFF000000
+
+static int acer_input_mapping(struct hid_device *hdev, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage,
+		unsigned long **bit, int *max)
+{
+	if ((field->application & HID_USAGE_PAGE) >= ACER_VENDOR_PAGE)
+		return -1;
+
+	return 0;
+}
+
+/* Stamp the input devices fed by this report with the time the report
+ * arrived, so evdev clients see the arrival time instead of the time
+ * hid-input finished decoding it. The timestamp is cleared by the core on
+ * the next SYN_REPORT.
+ */
+static void acer_stamp_report(struct hid_report *report, ktime_t now)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+	unsigned int i;
+
+	for (i = 0; i < report->maxfield; i++) {
+		struct hid_input *hidinput = report->field[i]->hidinput;
+
+		if (hidinput)
+			input_set_timestamp(hidinput->input, now);
+	}
+#endif
+}
+
+/* The measurement is armed by an autosuspend. The start of the resume and
+ * the first report may be seen in either order, whichever comes second
+ * completes the sample. Called with drvdata->lock held.
+ */
+static s64 acer_complete_wake(struct acer_data *drvdata)
+{
+	s64 latency;
+
+	if (!drvdata->wake_start_ns || !drvdata->wake_report_ns)
+		return 0;
+
+	latency = drvdata->wake_report_ns - drvdata->wake_start_ns;
+	drvdata->wake_pending = false;
+	if (latency > 0)
+		drvdata->wake_latency_ns = latency;
+
+	return latency;
+}
+
+static void acer_record_wake_latency(struct hid_device *hdev, ktime_t now)
+{
+	struct acer_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
+	s64 latency = 0;
+
+	/* nothing armed, keep the lock off the report path */
+	if (!READ_ONCE(drvdata->wake_pending))
+		return;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	if (drvdata->wake_pending && !drvdata->wake_report_ns) {
+		drvdata->wake_report_ns = ktime_to_ns(now);
+		latency = acer_complete_wake(drvdata);
+	}
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	if (latency > 0)
+		hid_dbg(hdev, "first report %llu us after autoresume\n",
+			div_u64(latency, NSEC_PER_USEC));
+}
+
+static int acer_raw_event(struct hid_device *hdev, struct hid_report *report,
+		u8 *data, int size)
+{
+	ktime_t now = ktime_get();
+
+	acer_stamp_report(report, now);
+	acer_record_wake_latency(hdev, now);
+
+	return 0;
+}
+
+/* Disable-while-typing: the keyboard and the touchpad share one USB
+ * device, so the driver sees both streams and can drop touchpad motion and
+ * touches shortly after a key press. The keyboard and the touchpad may bind
+ * as separate HID devices, so the time of the last key press lives in the
+ * shared per-USB-device state (4.14+, see acer_get_usb_device()).
+ *
+ * Taps are only suppressed for touchpads reporting through the Digitizer
+ * page. A touchpad in mouse mode reports taps as Button page presses,
+ * which cannot be told apart from physical clicks and are passed on, as
+ * are all releases, so clicks are not lost and nothing stays pressed.
+ */
+#define ACER_KBD_MODIFIER_MIN		0xE0
+#define ACER_KBD_MODIFIER_MAX		0xE7
+
+static bool acer_is_pointer(struct hid_field *field)
+{
+	return field->application == HID_GD_MOUSE ||
+	       field->application == HID_GD_POINTER ||
+	       field->application == HID_DG_TOUCHPAD;
+}
+
+static int acer_event(struct hid_device *hdev, struct hid_field *field,
+		struct hid_usage *usage, __s32 value)
+{
+	struct acer_data *drvdata = hid_get_drvdata(hdev);
+	struct acer_shared *shared = drvdata->shared;
+	unsigned int timeout = READ_ONCE(dwt_timeout_ms);
+	unsigned int code = usage->hid & HID_USAGE;
+	unsigned long last_key;
+
+	if (!timeout)
+		return 0;
+
+	if ((usage->hid & HID_USAGE_PAGE) == HID_UP_KEYBOARD) {
+		if (value && usage->type == EV_KEY &&
+		    (code < ACER_KBD_MODIFIER_MIN || code > ACER_KBD_MODIFIER_MAX))
+			WRITE_ONCE(shared->last_key, jiffies);
+		return 0;
+	}
+
+	if (!acer_is_pointer(field))
+		return 0;
+
+	last_key = READ_ONCE(shared->last_key);
+	if (!last_key ||
+	    time_after(jiffies, last_key + msecs_to_jiffies(timeout)))
+		return 0;
+
+	/* drop motion */
+	if (usage->type == EV_REL || usage->type == EV_ABS)
+		return 1;
+
+	/* drop touches and taps (tip switch, touch, BTN_TOOL_*), keep releases */
+	if (usage->type == EV_KEY && value &&
+	    (usage->hid & HID_USAGE_PAGE) == HID_UP_DIGITIZER)
+		return 1;
+
+	return 0;
+}
+
+static ssize_t wake_latency_us_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct acer_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
+	u64 latency;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	latency = drvdata->wake_latency_ns;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return sprintf(buf, "%llu\n", div_u64(latency, NSEC_PER_USEC));
+}
+static DEVICE_ATTR_RO(wake_latency_us);
+
+static struct usb_device *acer_get_usb_device(struct hid_device *hdev)
+{
+/* uhid devices may claim BUS_USB, so only the ll driver proves the parent
+ * is a usb_interface. Older kernels cannot tell and get no USB handling.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	if (!hid_is_using_ll_driver(hdev, &usb_hid_driver))
+		return NULL;
+
+	return interface_to_usbdev(to_usb_interface(hdev->dev.parent));
+#else
+	return NULL;
+#endif
+}
+
+/* Autosuspend is a setting of the USB device, so it is changed when the
+ * first interface binds and restored when the last one goes away.
+ */
+static void acer_enable_autosuspend(struct hid_device *hdev,
+		struct acer_shared *shared, struct usb_device *udev)
+{
+#ifdef CONFIG_PM
+	if (autosuspend_delay < 0 || !udev)
+		return;
+
+	shared->udev = udev;
+	shared->saved_delay = udev->dev.power.autosuspend_delay;
+	shared->saved_auto = udev->dev.power.runtime_auto;
+
+	pm_runtime_set_autosuspend_delay(&udev->dev, autosuspend_delay);
+	usb_enable_autosuspend(udev);
+	hid_dbg(hdev, "autosuspend enabled, delay %d ms\n", autosuspend_delay);
+#endif
+}
+
+static void acer_restore_autosuspend(struct acer_shared *shared)
+{
+#ifdef CONFIG_PM
+	struct usb_device *udev = shared->udev;
+
+	if (!udev)
+		return;
+
+	if (!shared->saved_auto)
+		usb_disable_autosuspend(udev);
+	pm_runtime_set_autosuspend_delay(&udev->dev, shared->saved_delay);
+#endif
+}
+
+static struct acer_shared *acer_shared_get(struct hid_device *hdev)
+{
+	struct usb_device *udev = acer_get_usb_device(hdev);
+	void *key = udev ? (void *)udev : (void *)hdev;
+	struct acer_shared *shared;
+
+	mutex_lock(&acer_shared_mutex);
+
+	list_for_each_entry(shared, &acer_shared_list, list) {
+		if (shared->key == key) {
+			shared->refcount++;
+			goto out;
+		}
+	}
+
+	shared = kzalloc(sizeof(*shared), GFP_KERNEL);
+	if (shared) {
+		shared->key = key;
+		shared->refcount = 1;
+		list_add(&shared->list, &acer_shared_list);
+		acer_enable_autosuspend(hdev, shared, udev);
+	}
+
+out:
+	mutex_unlock(&acer_shared_mutex);
+	return shared;
+}
+
+static void acer_shared_put(struct acer_shared *shared)
+{
+	mutex_lock(&acer_shared_mutex);
+
+	if (!--shared->refcount) {
+		list_del(&shared->list);
+		acer_restore_autosuspend(shared);
+		kfree(shared);
+	}
+
+	mutex_unlock(&acer_shared_mutex);
+}
+
+static int acer_probe(struct hid_device *hdev, const struct hid_device_id *id)
+{
+	struct acer_data *drvdata;
+	int ret;
+
+	if (!(connect_mask & (HID_CONNECT_HIDINPUT | HID_CONNECT_HIDRAW |
+			      HID_CONNECT_HIDDEV))) {
+		hid_err(hdev, "connect_mask 0x%x connects nothing\n",
+			connect_mask);
+		return -EINVAL;
+	}
+
+	drvdata = devm_kzalloc(&hdev->dev, sizeof(*drvdata), GFP_KERNEL);
+	if (!drvdata)
+		return -ENOMEM;
+
+	spin_lock_init(&drvdata->lock);
+	drvdata->udev = acer_get_usb_device(hdev);
+	hid_set_drvdata(hdev, drvdata);
+
+	drvdata->shared = acer_shared_get(hdev);
+	if (!drvdata->shared)
+		return -ENOMEM;
+
+	ret = hid_parse(hdev);
+	if (ret) {
+		hid_err(hdev, "parse failed\n");
+		goto err_put;
+	}
+
+	ret = hid_hw_start(hdev, connect_mask);
+	if (ret) {
+		hid_err(hdev, "hw start failed\n");
+		goto err_put;
+	}
+
+	ret = device_create_file(&hdev->dev, &dev_attr_wake_latency_us);
+	if (ret)
+		hid_warn(hdev, "failed to create wake_latency_us attribute\n");
+
+	return 0;
+
+err_put:
+	acer_shared_put(drvdata->shared);
+	return ret;
+}
+
+static void acer_remove(struct hid_device *hdev)
+{
+	struct acer_data *drvdata = hid_get_drvdata(hdev);
+
+	device_remove_file(&hdev->dev, &dev_attr_wake_latency_us);
+	hid_hw_stop(hdev);
+	acer_shared_put(drvdata->shared);
+}
+
+#ifdef CONFIG_PM
+static int acer_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct acer_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
+
+	/* only an autoresume is caused by a pending report, a system resume
+	 * may be followed by hours without input
+	 */
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->wake_start_ns = 0;
+	drvdata->wake_report_ns = 0;
+	WRITE_ONCE(drvdata->wake_pending, PMSG_IS_AUTO(message));
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return 0;
+}
+
+/* usbhid calls .resume from the runtime resume callback of the USB device,
+ * after the device has been resumed and the interrupt URB resubmitted. The
+ * USB device is still RPM_RESUMING then, and since 5.1 its runtime PM
+ * accounting timestamp is the monotonic time it left RPM_SUSPENDED, i.e.
+ * the start of the resume. Older kernels only get the time of this call.
+ */
+static u64 acer_resume_start_ns(struct acer_data *drvdata)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+	struct usb_device *udev = drvdata->udev;
+
+	if (udev && udev->dev.power.runtime_status == RPM_RESUMING)
+		return udev->dev.power.accounting_timestamp;
+#endif
+
+	return ktime_to_ns(ktime_get());
+}
+
+static int acer_resume(struct hid_device *hdev)
+{
+	struct acer_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
+	s64 latency = 0;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	if (drvdata->wake_pending && !drvdata->wake_start_ns) {
+		drvdata->wake_start_ns = acer_resume_start_ns(drvdata);
+		latency = acer_complete_wake(drvdata);
+	}
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	if (latency > 0)
+		hid_dbg(hdev, "first report %llu us after autoresume\n",
+			div_u64(latency, NSEC_PER_USEC));
+
+	return 0;
+}
+#endif
+
 static const struct hid_device_id acer_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_ACER_SYNAPTICS,
 		USB_VENDOR_ID_ACER_SYNAPTICS_TP_2968) },
@@ -66,7 +492,17 @@ MODULE_DEVICE_TABLE(hid, acer_devices);
 static struct hid_driver acer_driver = {
 	.name = "acer",
 	.id_table = acer_devices,
+	.probe = acer_probe,
+	.remove = acer_remove,
 	.report_fixup = acer_kbd_report_fixup,
+	.input_mapping = acer_input_mapping,
+	.raw_event = acer_raw_event,
+	.event = acer_event,
+#ifdef CONFIG_PM
+	.suspend = acer_suspend,
+	.resume = acer_resume,
+	.reset_resume = acer_resume,
+#endif
 };
 module_hid_driver(acer_driver);
 